@@ -24,6 +24,182 @@ static void apuWrite(void* arg, unsigned short addr, unsigned char value) { ((Op
 static unsigned char readMemory(void* arg, unsigned short addr) { return ((OpenNES*)arg)->mmu->readMemory(addr); }
 static void writeMemory(void* arg, unsigned short addr, unsigned char value) { ((OpenNES*)arg)->mmu->writeMemory(addr, value); }
 
+static void cpuWatchHit(void* arg, unsigned char flag, unsigned short addr, unsigned char value)
+{
+    OpenNES* nes = (OpenNES*)arg;
+    nes->notifyWatchHit(OpenNES::WatchTarget::CPUAddress, flag, addr, value);
+}
+
+static void ppuWatchHit(void* arg, unsigned char flag, unsigned short addr, unsigned char value)
+{
+    OpenNES* nes = (OpenNES*)arg;
+    nes->notifyWatchHit(OpenNES::WatchTarget::PPUAddress, flag, addr, value);
+}
+
+struct IdleLoop {
+    unsigned short target; // polling address (WRAM, SRAM or $2002)
+    unsigned char load;    // LDA, LDX, LDY or BIT (absolute) / JMP to itself
+    unsigned char op;      // AND, ORA, EOR, CMP, CPX or CPY with the immediate value (0: none)
+    unsigned char imm;     // immediate value of op
+    unsigned char branch;  // backward branch to the top of the loop
+    int cycles;            // CPU clocks of an iteration
+    int length;            // bytes of the loop
+};
+
+static bool decodeIdleLoop(MMU* mmu, unsigned short addr, struct IdleLoop* loop)
+{
+    unsigned char code[7];
+    for (int i = 0; i < 7; i++) {
+        if (!mmu->peekMemory(addr + i, &code[i])) return false;
+    }
+    memset(loop, 0, sizeof(struct IdleLoop));
+    if (code[0] == 0x4C && (code[1] | code[2] << 8) == addr) {
+        loop->load = 0x4C; // JMP to itself
+        loop->cycles = 3;
+        loop->length = 3;
+        return true;
+    }
+    int ptr;
+    switch (code[0]) {
+        case 0xAD: // LDA abs
+        case 0xAE: // LDX abs
+        case 0xAC: // LDY abs
+        case 0x2C: // BIT abs
+            loop->target = code[1] | code[2] << 8;
+            loop->cycles = 4;
+            ptr = 3;
+            break;
+        case 0xA5: // LDA zp
+        case 0xA6: // LDX zp
+        case 0xA4: // LDY zp
+        case 0x24: // BIT zp
+            loop->target = code[1];
+            loop->cycles = 3;
+            ptr = 2;
+            break;
+        default: return false;
+    }
+    loop->load = code[0] | 0x08; // zero page -> absolute
+    if (!(loop->target < 0x2000 || (loop->target & 0xE007) == 0x2002 || (0x6000 <= loop->target && loop->target < 0x8000))) return false;
+    switch (code[ptr]) {
+        case 0x29: // AND #imm
+        case 0x09: // ORA #imm
+        case 0x49: // EOR #imm
+        case 0xC9: // CMP #imm
+            if (loop->load != 0xAD) return false;
+            loop->op = code[ptr];
+            break;
+        case 0xE0: // CPX #imm
+            if (loop->load != 0xAE) return false;
+            loop->op = code[ptr];
+            break;
+        case 0xC0: // CPY #imm
+            if (loop->load != 0xAC) return false;
+            loop->op = code[ptr];
+            break;
+    }
+    if (loop->op) {
+        loop->imm = code[ptr + 1];
+        loop->cycles += 2;
+        ptr += 2;
+    }
+    switch (code[ptr]) {
+        case 0x10: // BPL
+        case 0x30: // BMI
+        case 0x50: // BVC
+        case 0x70: // BVS
+        case 0x90: // BCC
+        case 0xB0: // BCS
+        case 0xD0: // BNE
+        case 0xF0: // BEQ
+            break;
+        default: return false;
+    }
+    unsigned short next = addr + ptr + 2;
+    if ((unsigned short)(next + (signed char)code[ptr + 1]) != addr) return false;
+    loop->branch = code[ptr];
+    loop->length = ptr + 2;
+    loop->cycles += (next & 0xFF00) == (addr & 0xFF00) ? 3 : 4;
+    return true;
+}
+
+// evaluate whether an iteration that reads the value loops again
+static bool isIdleBranchTaken(M6502* cpu, struct IdleLoop* loop, unsigned char value)
+{
+    if (loop->load == 0x4C) return true;
+    unsigned char p = cpu->R.p;
+    unsigned char r;
+    switch (loop->load) {
+        case 0x2C: // BIT
+            p &= 0b00111101;
+            p |= value & 0b11000000;
+            if (0 == (cpu->R.a & value)) p |= 0b00000010;
+            r = value;
+            break;
+        default: r = value; // LDA, LDX, LDY
+    }
+    switch (loop->op) {
+        case 0x29: r &= loop->imm; break;
+        case 0x09: r |= loop->imm; break;
+        case 0x49: r ^= loop->imm; break;
+    }
+    if (loop->load != 0x2C) {
+        p &= 0b01111101;
+        if (0 == r) p |= 0b00000010;
+        p |= r & 0b10000000;
+    }
+    switch (loop->op) {
+        case 0xC9:
+        case 0xE0:
+        case 0xC0:
+            p &= 0b01111100;
+            if (loop->imm <= r) p |= 0b00000001;
+            if (loop->imm == r) p |= 0b00000010;
+            p |= (unsigned char)(r - loop->imm) & 0b10000000;
+            break;
+    }
+    switch (loop->branch) {
+        case 0x10: return 0 == (p & 0b10000000); // BPL
+        case 0x30: return 0 != (p & 0b10000000); // BMI
+        case 0x50: return 0 == (p & 0b01000000); // BVC
+        case 0x70: return 0 != (p & 0b01000000); // BVS
+        case 0x90: return 0 == (p & 0b00000001); // BCC
+        case 0xB0: return 0 != (p & 0b00000001); // BCS
+        case 0xD0: return 0 == (p & 0b00000010); // BNE
+        case 0xF0: return 0 != (p & 0b00000010); // BEQ
+    }
+    return false;
+}
+
+// breakReasons: skip only if no other breakpoint is in the loop (they must be hit at every iteration)
+// clocksLeft: CPU clocks left in the current tick
+static void idleLoopHit(OpenNES* nes, const unsigned char* breakReasons, unsigned char idleReason, int clocksLeft)
+{
+    struct IdleLoop loop;
+    if (nes->mmu->isWatching() || !decodeIdleLoop(nes->mmu, nes->cpu->R.pc, &loop)) return;
+    for (int i = 0; i < loop.length; i++) {
+        if (breakReasons[(unsigned short)(nes->cpu->R.pc + i)] & ~idleReason) return;
+    }
+    unsigned char value = 0;
+    if (loop.load != 0x4C) {
+        if (loop.target < 0x2000 || 0x6000 <= loop.target) {
+            if (!nes->mmu->peekMemory(loop.target, &value)) return;
+        } else {
+            // skip only if reading $2002 has no side effect (it clears the vblank flag, the toggle and the pending VRAM address update)
+            if (nes->ppu->R.internalFlag || (nes->ppu->R.status & 0b10000000)) return;
+            value = nes->ppu->R.status;
+        }
+    }
+    if (!isIdleBranchTaken(nes->cpu, &loop, value)) return;
+    // skip the iterations that end before the next PPU event or the end of the tick (keep a margin of an iteration)
+    int clocks = nes->ppu->getClocksUntilNextEvent() / 3;
+    if (clocksLeft < clocks) clocks = clocksLeft;
+    clocks -= loop.cycles + 2;
+    for (int i = clocks / loop.cycles; 0 < i; i--) {
+        nes->cpu->consumeClock(loop.cycles);
+    }
+}
+
 static void oamdma(void* arg, unsigned char page)
 {
     fprintf(stderr, "EXECUTE OAM DMA\n");
@@ -34,33 +210,49 @@ static void oamdma(void* arg, unsigned char page)
     do {
         unsigned char data = readMemory(nes, addr);
         nes->cpu->consumeClock(1);
-        nes->ppu->M.oam[addr & 0xFF] = data;
+        nes->ppu->writeOAM(addr & 0xFF, data);
         nes->cpu->consumeClock(1);
         addr++;
     } while (addr & 0xFF);
     nes->cpu->consumeClock(1);
 }
 
-OpenNES::OpenNES(bool isNTSC, ColorMode colorMode)
+OpenNES::OpenNES(bool isNTSC, ColorMode colorMode, bool compact, bool headless)
 {
     this->isNTSC = isNTSC;
+    this->compact = compact;
+    this->romImage = NULL;
+    memset(&watchCB, 0, sizeof(watchCB));
+    this->idleSkip = false;
+    this->tickClocksLeft = 0;
+    this->breakReasons = NULL;
     this->cpuClockHz = isNTSC ? 1789773 : 1773447;
     switch (colorMode) {
         case ColorMode::RGB555: this->colorTable = _colorTableRGB555; break;
         case ColorMode::RGB565: this->colorTable = _colorTableRGB565; break;
     }
+    // fall back to headless if the frame buffers can not be allocated
+    this->display = headless ? NULL : (unsigned short*)calloc(256 * 240, 2);
     this->apu = new APU();
-    this->ppu = new PPU();
-    ppu->setEndOfFrame(this, [](void* arg) {
+    this->ppu = new PPU(!display);
+    if (display && !ppu->display) {
+        free(display);
+        display = NULL;
+    }
+    this->renderer = NULL;
+    this->backDisplay = NULL;
+    _setEndOfFrame();
+    ppu->setWatchCallback(this, ppuWatchHit);
+    this->mmu = new MMU(ppuRead, ppuWrite, apuRead, apuWrite, oamdma, this, compact);
+    mmu->setWatchCallback(cpuWatchHit);
+    mmu->setBankCallback([](void* arg, int index) {
         OpenNES* nes = (OpenNES*)arg;
-        for (int i = 0; i < 256 * 240; i++) {
-            nes->display[i] = nes->colorTable[nes->ppu->display[i]];
-        }
+        if (nes->idleSkip) nes->_scanIdleLoops(0x8000 + index * 0x2000, 0xA000 + index * 0x2000);
     });
-    this->mmu = new MMU(ppuRead, ppuWrite, apuRead, apuWrite, oamdma, this);
     this->cpu = new M6502(M6502_MODE_RP2A03, readMemory, writeMemory, this);
     this->cpu->setConsumeClock([](void* arg) {
         OpenNES* nes = (OpenNES*)arg;
+        nes->tickClocksLeft--;
         // execute 3 PPU ticks
         // https://wiki.nesdev.com/w/index.php/PPU_frame_timing
         nes->ppu->tick(nes->cpu);
@@ -71,19 +263,26 @@ OpenNES::OpenNES(bool isNTSC, ColorMode colorMode)
 
 OpenNES::~OpenNES()
 {
+    if (this->renderer) delete this->renderer;
     if (this->cpu) delete this->cpu;
     if (this->mmu) delete this->mmu;
     if (this->ppu) delete this->ppu;
     if (this->apu) delete this->apu;
+    if (this->display) free(this->display);
+    if (this->backDisplay) free(this->backDisplay);
+    if (this->breakReasons) free(this->breakReasons);
+    if (this->romImage) free(this->romImage);
 }
 
 bool OpenNES::loadRom(void* data, size_t size)
 {
+    _clearIdleLoops();
+    if (renderer) renderer->wait();
     bool result = this->mmu ? mmu->loadRom((unsigned char*)data, size) : false;
-    if (result) {
-        ppu->setup(&mmu->romData, isNTSC);
-        this->reset();
-    }
+    if (result) result = ppu->setup(&mmu->romData, isNTSC, compact);
+    if (result && renderer) result = renderer->reset();
+    if (result && idleSkip) _scanIdleLoops();
+    if (result) this->reset();
     return result;
 }
 
@@ -109,13 +308,21 @@ bool OpenNES::loadRomFile(const char* filename)
     }
     fclose(fp);
     bool result = loadRom(data, size);
-    free(data);
+    if (mmu && mmu->romData.isReference) {
+        // the loaded ROM refers to the file image in compact mode
+        if (romImage) free(romImage);
+        romImage = data;
+    } else {
+        free(data);
+    }
     return result;
 }
 
 void OpenNES::reset()
 {
-    memset(display, 0, sizeof(display));
+    if (renderer) renderer->wait();
+    if (display) memset(display, 0, 256 * 240 * 2);
+    if (backDisplay) memset(backDisplay, 0, 256 * 240 * 2);
     if (cpu) cpu->reset();
 }
 
@@ -124,5 +331,210 @@ void OpenNES::tick(unsigned char pad1, unsigned char pad2)
     if (!cpu || !mmu) return;
     mmu->R.pad[0] = pad1;
     mmu->R.pad[1] = pad2;
-    cpu->execute(cpuClockHz / 60);
-}
\ No newline at end of file
+    tickClocksLeft = cpuClockHz / 60;
+    cpu->execute(tickClocksLeft);
+    tickClocksLeft = 0;
+    mmu->flushSaveFileIfNeeded();
+}
+
+void OpenNES::setWatchCallback(void* arg, void (*hit)(void* arg, WatchTarget target, unsigned char flag, unsigned short addr, unsigned char value))
+{
+    watchCB.arg = arg;
+    watchCB.hit = hit;
+}
+
+bool OpenNES::addWatchPoint(WatchTarget target, unsigned short from, unsigned short to, unsigned char flags)
+{
+    if (target == WatchTarget::PPUAddress) return ppu->addWatchPoint(from, to, flags);
+    if (flags & MMU::WatchExecute) {
+        for (unsigned int addr = from; addr <= to; addr++) _setBreakReason(addr, BreakWatch, true);
+    }
+    flags &= ~MMU::WatchExecute;
+    return flags ? mmu->addWatchPoint(from, to, flags) : true;
+}
+
+void OpenNES::removeWatchPoint(WatchTarget target, unsigned short from, unsigned short to, unsigned char flags)
+{
+    if (target == WatchTarget::PPUAddress) {
+        ppu->removeWatchPoint(from, to, flags);
+        return;
+    }
+    if (flags & MMU::WatchExecute) {
+        for (unsigned int addr = from; addr <= to; addr++) _setBreakReason(addr, BreakWatch, false);
+    }
+    flags &= ~MMU::WatchExecute;
+    if (flags) mmu->removeWatchPoint(from, to, flags);
+}
+
+void OpenNES::removeAllWatchPoints()
+{
+    for (unsigned int addr = 0; addr < 0x10000; addr++) _setBreakReason(addr, BreakWatch, false);
+    mmu->removeAllWatchPoints();
+    ppu->removeAllWatchPoints();
+}
+
+void OpenNES::addBreakPoint(unsigned short addr, void (*callback)(void* arg))
+{
+    UserBreakPoint bp;
+    bp.addr = addr;
+    bp.callback = callback;
+    userBreakPoints.push_back(bp);
+    _setBreakReason(addr, BreakUser, true);
+}
+
+void OpenNES::removeBreakPoint(unsigned short addr)
+{
+    for (size_t i = 0; i < userBreakPoints.size();) {
+        if (userBreakPoints[i].addr == addr) {
+            userBreakPoints.erase(userBreakPoints.begin() + i);
+        } else {
+            i++;
+        }
+    }
+    _setBreakReason(addr, BreakUser, false);
+}
+
+void OpenNES::_setBreakReason(unsigned short addr, unsigned char reason, bool set)
+{
+    if (!breakReasons) {
+        if (!set || NULL == (breakReasons = (unsigned char*)calloc(0x10000, 1))) return;
+    }
+    unsigned char previous = breakReasons[addr];
+    breakReasons[addr] = set ? previous | reason : previous & ~reason;
+    if (!previous && breakReasons[addr]) {
+        cpu->addBreakPoint(addr, [](void* arg) { ((OpenNES*)arg)->_dispatchBreak(); });
+    } else if (previous && !breakReasons[addr]) {
+        cpu->removeBreakPoint(addr);
+    }
+}
+
+void OpenNES::_dispatchBreak()
+{
+    unsigned short pc = cpu->R.pc;
+    unsigned char reason = breakReasons ? breakReasons[pc] : 0;
+    if (reason & BreakWatch) notifyWatchHit(WatchTarget::CPUAddress, MMU::WatchExecute, pc, 0);
+    if (reason & BreakUser) {
+        for (size_t i = 0; i < userBreakPoints.size(); i++) {
+            if (userBreakPoints[i].addr == pc) userBreakPoints[i].callback(this);
+        }
+    }
+    if (reason & BreakIdle) idleLoopHit(this, breakReasons, BreakIdle, tickClocksLeft);
+}
+
+void OpenNES::setIdleSkip(bool enable)
+{
+    _clearIdleLoops();
+    idleSkip = enable;
+    if (idleSkip && mmu->romData.prgData) _scanIdleLoops();
+}
+
+void OpenNES::_scanIdleLoops()
+{
+    _scanIdleLoops(0x8000, 0x10000);
+}
+
+// scan [from, to) again (a loop can start up to 6 bytes before the switched bank)
+void OpenNES::_scanIdleLoops(unsigned int from, unsigned int to)
+{
+    from = from < 0x8006 ? 0x8000 : from - 6;
+    struct IdleLoop loop;
+    for (unsigned int addr = from; addr < to; addr++) {
+        _setBreakReason(addr, BreakIdle, decodeIdleLoop(mmu, addr, &loop));
+    }
+}
+
+void OpenNES::_clearIdleLoops()
+{
+    if (!breakReasons) return;
+    for (unsigned int addr = 0x8000; addr < 0x10000; addr++) _setBreakReason(addr, BreakIdle, false);
+}
+
+OpenNES::Observation OpenNES::observe(ObserveRegion region)
+{
+    Observation result;
+    MMU::DirtyRange* dirty;
+    switch (region) {
+        case ObserveRegion::RAM:
+            result.data = mmu->M.ram;
+            result.size = sizeof(mmu->M.ram);
+            dirty = &mmu->ramDirty;
+            break;
+        case ObserveRegion::OAM:
+            result.data = ppu->M.oam;
+            result.size = sizeof(ppu->M.oam);
+            dirty = &ppu->D.oam;
+            break;
+        case ObserveRegion::Palette:
+            result.data = &ppu->M.palette[0][0];
+            result.size = sizeof(ppu->M.palette);
+            dirty = &ppu->D.palette;
+            break;
+        case ObserveRegion::NameTable:
+        default:
+            result.data = &ppu->M.nameBuffer[0][0];
+            result.size = sizeof(ppu->M.nameBuffer);
+            dirty = &ppu->D.name;
+            break;
+    }
+    result.changed = dirty->isChanged();
+    result.changedFrom = result.changed ? dirty->from : 0;
+    result.changedTo = result.changed ? dirty->to : 0;
+    dirty->observed();
+    result.generation = dirty->generation;
+    return result;
+}
+
+bool OpenNES::setParallelRendering(bool enable)
+{
+    if (!display) return false;
+    if (enable && !renderer) {
+        if (NULL == (backDisplay = (unsigned short*)calloc(256 * 240, 2))) return false;
+        renderer = new Renderer(ppu);
+        ppu->setHeadless(true); // the PPU on this thread only records the access log
+    } else if (!enable && renderer) {
+        if (!ppu->setHeadless(false)) return false;
+        delete renderer;
+        renderer = NULL;
+        free(backDisplay);
+        backDisplay = NULL;
+    }
+    _setEndOfFrame();
+    return true;
+}
+
+unsigned short* OpenNES::getLatestDisplay()
+{
+    if (!renderer) return display;
+    renderer->wait();
+    return backDisplay;
+}
+
+void OpenNES::_setEndOfFrame()
+{
+    if (!display) return;
+    if (!renderer) {
+        ppu->setEndOfFrame(this, [](void* arg) {
+            OpenNES* nes = (OpenNES*)arg;
+            for (int i = 0; i < 256 * 240; i++) {
+                nes->display[i] = nes->colorTable[nes->ppu->display[i]];
+            }
+        });
+        return;
+    }
+    // emulation thread: show the previous frame and pass the access log of this frame to the renderer
+    ppu->setEndOfFrame(this, [](void* arg) {
+        OpenNES* nes = (OpenNES*)arg;
+        nes->renderer->wait();
+        unsigned short* display = nes->display;
+        nes->display = nes->backDisplay;
+        nes->backDisplay = display;
+        nes->renderer->submit();
+    });
+    // worker thread
+    renderer->ppu->setEndOfFrame(this, [](void* arg) {
+        OpenNES* nes = (OpenNES*)arg;
+        for (int i = 0; i < 256 * 240; i++) {
+            nes->backDisplay[i] = nes->colorTable[nes->renderer->ppu->display[i]];
+        }
+    });
+}
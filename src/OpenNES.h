@@ -5,7 +5,9 @@
 #include "apu.hpp"
 #include "mmu.hpp"
 #include "ppu.hpp"
+#include "renderer.hpp"
 #include <stdio.h>
+#include <vector>
 
 class OpenNES
 {
@@ -15,10 +17,60 @@ class OpenNES
         RGB565,
     };
 
+    enum ObserveRegion {
+        RAM,       // WRAM (2KB)
+        OAM,       // sprite attributes (256 bytes)
+        Palette,   // BG and sprite palettes (32 bytes)
+        NameTable, // name tables and attribute tables (4KB: 1KB x 4)
+    };
+
+    struct Observation {
+        const unsigned char* data; // read-only view of the region (valid while the instance exists)
+        size_t size;               // size of the region
+        unsigned int generation;   // incremented every time the region is observed with any change
+        bool changed;              // changed since the last observation of the region
+        size_t changedFrom;        // changed range: [changedFrom, changedTo)
+        size_t changedTo;
+    };
+
+    enum WatchTarget {
+        CPUAddress, // $0000-$FFFF (MMU::WatchRead, WatchWrite, WatchChange and WatchExecute)
+        PPUAddress, // $0000-$3FFF (MMU::WatchRead, WatchWrite and WatchChange)
+    };
+
   private:
+    struct WatchCallback {
+        void* arg;
+        void (*hit)(void* arg, WatchTarget target, unsigned char flag, unsigned short addr, unsigned char value);
+    } watchCB;
     bool isNTSC;
+    bool compact;
     int cpuClockHz;
     const unsigned short* colorTable;
+    unsigned char* romImage; // ROM file image kept by loadRomFile in compact mode
+    bool idleSkip;
+    int tickClocksLeft; // CPU clocks left in the current tick (the idle skip does not cross the end of the tick)
+    void _scanIdleLoops();
+    void _scanIdleLoops(unsigned int from, unsigned int to);
+    void _clearIdleLoops();
+
+    // The execute watchpoints, the idle loops and the user breakpoints share one breakpoint of M6502 per address
+    enum BreakReason {
+        BreakUser = 0b001,
+        BreakWatch = 0b010,
+        BreakIdle = 0b100,
+    };
+    struct UserBreakPoint {
+        unsigned short addr;
+        void (*callback)(void* arg);
+    };
+    unsigned char* breakReasons; // BreakReason of each address (NULL if no breakpoint)
+    std::vector<UserBreakPoint> userBreakPoints;
+    void _setBreakReason(unsigned short addr, unsigned char reason, bool set);
+    void _dispatchBreak();
+    Renderer* renderer;          // NULL if the parallel rendering is disabled
+    unsigned short* backDisplay; // display that is being rendered by the renderer
+    void _setEndOfFrame();
 
   public:
     APU* apu;
@@ -26,13 +78,72 @@ class OpenNES
     MMU* mmu;
     M6502* cpu;
     unsigned int tickCount;
-    unsigned short display[256 * 240];
-    OpenNES(bool isNTSC, ColorMode colorMode);
+    unsigned short* display; // 256x240 (NULL if headless)
+
+    /**
+     * compact: allocate ExRAM/SRAM only if the ROM needs them and refer the ROM data without copying
+     *          (the buffer passed to loadRom must be kept until the instance is deleted or other ROM is loaded)
+     * headless: do not allocate the frame buffers (display and ppu->display become NULL)
+     *           the instance also becomes headless if the frame buffers can not be allocated
+     */
+    OpenNES(bool isNTSC, ColorMode colorMode, bool compact = false, bool headless = false);
     ~OpenNES();
     bool loadRom(void* data, size_t size);
     bool loadRomFile(const char* filename);
     void reset();
     void tick(unsigned char pad1, unsigned char pad2);
+
+    // Battery backup: SRAM is mapped to the file and dirty blocks are flushed every flushInterval frames (default: 60)
+    bool openSaveFile(const char* filename) { return mmu ? mmu->openSaveFile(filename) : false; }
+    void closeSaveFile()
+    {
+        if (mmu) mmu->closeSaveFile();
+    }
+    void setSaveFileFlushInterval(int frames)
+    {
+        if (mmu) mmu->setSaveFileFlushInterval(frames);
+    }
+
+    /**
+     * Idle loop skip: the spin loops polling WRAM, SRAM or $2002 without any write (and JMP to itself) are detected
+     * from PRG-ROM, and their iterations that can not observe any change are skipped until just before the next PPU event.
+     * The skipped CPU clocks are consumed as is and never cross the end of the tick, so the result is same as executing the loop.
+     * A loop polling $2002 is skipped only while the read has no side effect (vblank flag and write toggle are clear).
+     * The window of PRG-ROM is scanned again when MMU::setBank switches the bank.
+     */
+    void setIdleSkip(bool enable);
+
+    /**
+     * Parallel rendering: the pixels are drawn by the PPU on the worker thread that replays the access log.
+     * The display is updated at the start of vblank with the previous frame (1 frame latency).
+     * Returns false if the instance is headless.
+     */
+    bool setParallelRendering(bool enable);
+
+    /**
+     * Returns the last frame that has been completed by the PPU.
+     * It is same as display if the parallel rendering is disabled, otherwise waits for the renderer and returns
+     * the frame that will be the display at the next vblank (valid until the next tick).
+     */
+    unsigned short* getLatestDisplay();
+
+    // Observe the region without copying and reset the changed range of the region
+    Observation observe(ObserveRegion region);
+
+    // Breakpoints: use these instead of cpu->addBreakPoint (the callback receives this instance as arg)
+    void addBreakPoint(unsigned short addr, void (*callback)(void* arg));
+    void removeBreakPoint(unsigned short addr);
+
+    // Watchpoints: there is no overhead except a NULL check while no watchpoint is armed
+    void setWatchCallback(void* arg, void (*hit)(void* arg, WatchTarget target, unsigned char flag, unsigned short addr, unsigned char value));
+    bool addWatchPoint(WatchTarget target, unsigned short from, unsigned short to, unsigned char flags);
+    void removeWatchPoint(WatchTarget target, unsigned short from, unsigned short to, unsigned char flags);
+    void removeAllWatchPoints();
+    void notifyWatchHit(WatchTarget target, unsigned char flag, unsigned short addr, unsigned char value)
+    {
+        if (watchCB.hit) watchCB.hit(watchCB.arg, target, flag, addr, value);
+    }
+
     void enableDebug()
     {
         if (cpu) {
@@ -2,25 +2,153 @@
 #ifndef INCLUDE_MMU_HPP
 #define INCLUDE_MMU_HPP
 #include "OpenNES.h"
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 class MMU
 {
   private:
     void* arg;
+    bool compact;
+
+    // Battery backup file that is memory-mapped as SRAM.
+    // Writes to $6000-$7FFF mark 1KB blocks as dirty and the dirty range is flushed by msync(MS_ASYNC)
+    // at most once per flushInterval frames, so the emulation never waits for the disk.
+    struct SaveFile {
+        int fd;
+        unsigned char* map;   // mapped file (M.sram refers this while the file is opened)
+        unsigned char* sram;  // M.sram before opening the file (restored at close)
+        unsigned char dirty;  // dirty bits of each 1KB block
+        int dirtyFrames;      // number of frames elapsed since the block became dirty
+        int flushInterval;    // number of frames to coalesce the dirty blocks
+    } SF;
+    bool sramWritten;
+
+    unsigned char* watch; // watch flags of each address (NULL if no watchpoint is armed)
+    void (*watchHit)(void* arg, unsigned char flag, unsigned short addr, unsigned char value);
+    void (*bankChanged)(void* arg, int index);
+
+    void _checkWriteWatch(unsigned short addr, unsigned char value)
+    {
+        unsigned char flag = watch[addr];
+        if ((flag & WatchChange) && _isChanged(addr, value)) {
+            if (watchHit) watchHit(arg, WatchChange, addr, value);
+        } else if (flag & WatchWrite) {
+            if (watchHit) watchHit(arg, WatchWrite, addr, value);
+        }
+    }
+
+    // the I/O registers are always regarded as changed
+    bool _isChanged(unsigned short addr, unsigned char value)
+    {
+        if (addr < 0x2000) return M.ram[addr & 0x7FF] != value;
+        if (addr < 0x4020) return true;
+        if (addr < 0x8000) return _readMemory(addr) != value;
+        return false;
+    }
+
+    // PRG-ROM of each 8KB window at $8000-$FFFF resolved from R.bank (NULL: out of PRG-ROM)
+    unsigned char* prgBank[4];
+
+    void _updateBanks()
+    {
+        for (int i = 0; i < 4; i++) {
+            size_t ptr = R.bank[i] * 0x2000;
+            prgBank[i] = romData.prgData && ptr + 0x2000 <= romData.prgSize ? &romData.prgData[ptr] : NULL;
+        }
+    }
+
+    inline unsigned char _readMemory(unsigned short addr)
+    {
+        if (addr & 0x8000) {
+            // fast path for the instruction fetch from PRG-ROM
+            unsigned char* bank = prgBank[(addr & 0b0110000000000000) >> 13];
+            if (bank) return bank[addr & 0x1FFF];
+        }
+        unsigned char page = (addr & 0xFF00) >> 8;
+        if (page < 0x20) return M.ram[addr & 0x7FF];                                                      // WRAM
+        if (page < 0x40) return ppuRead(arg, 0x2000 + (addr & 0b111));                                    // PPU I/O
+        if (addr < 0x4020) return apuRead(arg, addr);                                                     // APU I/O
+        if (page < 0x60) return M.exRam ? M.exRam[addr - 0x4000] : 0x00;                                  // ExRAM
+        if (romData.hasTrainer && 0x7000 <= addr && addr < 0x7200) return romData.trainer[addr - 0x7000]; // Trainer
+        if (page < 0x80) return M.sram ? M.sram[addr - 0x6000] : 0x00;                                    // SRAM (Battery backup)
+        // Read from ROM
+        unsigned int ptr = R.bank[(addr & 0b0110000000000000) >> 13];
+        ptr *= 0x2000;
+        ptr |= addr & 0x1FFF;
+        return ptr < romData.prgSize ? romData.prgData[ptr] : 0x00;
+    }
 
     void _freeData()
     {
-        if (romData.prgData) free(romData.prgData);
-        if (romData.chrData) free(romData.chrData);
+        if (!romData.isReference) {
+            if (romData.prgData) free(romData.prgData);
+            if (romData.chrData) free(romData.chrData);
+        }
         memset(&romData, 0, sizeof(romData));
     }
 
-    void _clearRAM()
+    void _freeRAM()
     {
-        memset(&M, 0, sizeof(M));
+        if (M.exRam) free(M.exRam);
+        if (M.sram) free(M.sram);
+        M.exRam = NULL;
+        M.sram = NULL;
+    }
+
+    bool _allocateRAM(bool needExRam, bool needSRam)
+    {
+        if (needExRam && !M.exRam) {
+            if (NULL == (M.exRam = (unsigned char*)malloc(0x2000))) return false;
+        } else if (!needExRam && M.exRam) {
+            free(M.exRam);
+            M.exRam = NULL;
+        }
+        if (needSRam && !M.sram) {
+            if (NULL == (M.sram = (unsigned char*)malloc(0x2000))) return false;
+        } else if (!needSRam && M.sram) {
+            free(M.sram);
+            M.sram = NULL;
+        }
+        _clearRAM();
+        return true;
+    }
+
+    // keepSRam: do not clear SRAM (it may be the battery backup file mapped by openSaveFile)
+    void _clearRAM(bool keepSRam = false)
+    {
+        memset(M.ram, 0, sizeof(M.ram));
+        ramDirty.markAll(sizeof(M.ram));
+        if (M.exRam) memset(M.exRam, 0, 0x2000);
+        if (M.sram && !keepSRam) {
+            memset(M.sram, 0, 0x2000);
+            sramWritten = false;
+            SF.dirty = SF.map ? 0xFF : 0;
+        }
         memset(&R, 0, sizeof(R));
+        _updateBanks();
+    }
+
+    // In compact mode, ExRAM is allocated only for the mapper that has it (MMC5)
+    bool _needsExRam() { return !compact || romData.mapper == 5; }
+
+    // In compact mode, SRAM is allocated only if the header or the mapper suggests PRG-RAM at $6000-$7FFF
+    bool _needsSRam(unsigned char* header)
+    {
+        if (!compact || romData.hasButtryBackup) return true;
+        if (romData.isNes20) return 0 != header[10];
+        if (header[8]) return true;
+        switch (romData.mapper) {
+            case 1: // MMC1
+            case 4: // MMC3
+            case 5: // MMC5
+                return true;
+        }
+        return false;
     }
 
     size_t _getSizeValue(unsigned int exponent, unsigned int multiplier)
@@ -31,6 +159,41 @@ class MMU
     }
 
   public:
+    enum WatchFlag {
+        WatchRead = 0b0001,    // read from the address
+        WatchWrite = 0b0010,   // write to the address (notified before the value is written)
+        WatchChange = 0b0100,  // write that changes the value of RAM, ExRAM or SRAM (notified before the value is written)
+        WatchExecute = 0b1000, // execute the address (CPU only / handled by OpenNES with the breakpoint of M6502)
+    };
+
+    // Changed range of a memory region since the last observation
+    struct DirtyRange {
+        unsigned short from;     // first changed offset
+        unsigned short to;       // last changed offset + 1 (not changed if from >= to)
+        unsigned int generation; // incremented when the region is observed with any change
+
+        inline void mark(unsigned short offset)
+        {
+            if (offset < from) from = offset;
+            if (to <= offset) to = offset + 1;
+        }
+
+        void markAll(unsigned short size)
+        {
+            from = 0;
+            to = size;
+        }
+
+        bool isChanged() { return from < to; }
+
+        void observed()
+        {
+            if (isChanged()) generation++;
+            from = 0xFFFF;
+            to = 0;
+        }
+    };
+
     struct RomData {
         unsigned char* prgData;       // raw data of ROM
         unsigned char* chrData;       // raw data of CHR
@@ -45,13 +208,15 @@ class MMU
         bool isNes20;                 // flags 8-15 are in NES 2.0 format
         bool isPlayChoice10;          // 8KB of Hint Screen data stored after CHR data (not part of the official specification)
         bool isVS;                    // VS Unisystem
+        bool isReference;             // prgData and chrData refer to the buffer passed to loadRom (compact mode)
     } romData;
 
     struct MainMemory {
-        unsigned char ram[0x800];    // WRAM
-        unsigned char exRam[0x2000]; // Extra RAM
-        unsigned char sram[0x2000];  // Battery backup
+        unsigned char ram[0x800]; // WRAM
+        unsigned char* exRam;     // Extra RAM (8KB: NULL if not allocated)
+        unsigned char* sram;      // Battery backup (8KB: NULL if not allocated)
     } M;
+    DirtyRange ramDirty;
 
     struct Register {
         unsigned char bank[4];
@@ -70,11 +235,22 @@ class MMU
         unsigned char (*apuRead)(void* arg, unsigned short addr),
         void (*apuWrite)(void* arg, unsigned short addr, unsigned char value),
         void (*oamdma)(void* arg, unsigned char page),
-        void* arg)
+        void* arg,
+        bool compact = false)
     {
         this->arg = arg;
-        _clearRAM();
+        this->compact = compact;
+        memset(&M, 0, sizeof(M));
         memset(&romData, 0, sizeof(romData));
+        memset(&SF, 0, sizeof(SF));
+        sramWritten = false;
+        memset(&ramDirty, 0, sizeof(ramDirty));
+        SF.fd = -1;
+        SF.flushInterval = 60;
+        watch = NULL;
+        watchHit = NULL;
+        bankChanged = NULL;
+        _allocateRAM(!compact, !compact);
         this->ppuRead = ppuRead;
         this->ppuWrite = ppuWrite;
         this->apuRead = apuRead;
@@ -84,30 +260,99 @@ class MMU
 
     ~MMU()
     {
+        closeSaveFile();
         _freeData();
+        _freeRAM();
+        if (watch) free(watch);
     }
 
-    unsigned char readMemory(unsigned short addr)
+    void setWatchCallback(void (*watchHit)(void* arg, unsigned char flag, unsigned short addr, unsigned char value))
     {
-        unsigned char page = (addr & 0xFF00) >> 8;
-        if (page < 0x20) return M.ram[addr & 0x7FF];                                                      // WRAM
-        if (page < 0x40) return ppuRead(arg, 0x2000 + (addr & 0b111));                                    // PPU I/O
-        if (addr < 0x4020) return apuRead(arg, addr);                                                     // APU I/O
-        if (page < 0x60) return M.exRam[addr - 0x4000];                                                   // ExRAM
-        if (romData.hasTrainer && 0x7000 <= addr && addr < 0x7200) return romData.trainer[addr - 0x7000]; // Trainer
-        if (page < 0x80) return M.sram[addr - 0x6000];                                                    // SRAM (Battery backup)
-        // Read from ROM
-        unsigned int ptr = R.bank[(addr & 0b0110000000000000) >> 13];
-        ptr *= 0x2000;
-        ptr |= addr & 0x1FFF;
-        return ptr < romData.prgSize ? romData.prgData[ptr] : 0x00;
+        this->watchHit = watchHit;
+    }
+
+    // called after the PRG-ROM bank of the window was switched by setBank or loadState
+    void setBankCallback(void (*bankChanged)(void* arg, int index))
+    {
+        this->bankChanged = bankChanged;
+    }
+
+    // the mirrors of WRAM ($0000-$1FFF) and the PPU I/O ($2000-$3FFF) are watched together
+    bool addWatchPoint(unsigned short from, unsigned short to, unsigned char flags)
+    {
+        if (!watch && NULL == (watch = (unsigned char*)calloc(0x10000, 1))) return false;
+        flags &= WatchRead | WatchWrite | WatchChange;
+        for (unsigned int addr = from; addr <= to; addr++) {
+            if (addr < 0x2000) {
+                for (int i = 0; i < 0x2000; i += 0x800) watch[(addr & 0x7FF) + i] |= flags;
+            } else if (addr < 0x4000) {
+                for (int i = 0x2000; i < 0x4000; i += 8) watch[(addr & 0b111) + i] |= flags;
+            } else {
+                watch[addr] |= flags;
+            }
+        }
+        return true;
+    }
+
+    // the watch table is released when all watchpoints are removed
+    void removeWatchPoint(unsigned short from, unsigned short to, unsigned char flags)
+    {
+        if (!watch) return;
+        for (unsigned int addr = from; addr <= to; addr++) {
+            if (addr < 0x2000) {
+                for (int i = 0; i < 0x2000; i += 0x800) watch[(addr & 0x7FF) + i] &= ~flags;
+            } else if (addr < 0x4000) {
+                for (int i = 0x2000; i < 0x4000; i += 8) watch[(addr & 0b111) + i] &= ~flags;
+            } else {
+                watch[addr] &= ~flags;
+            }
+        }
+        for (int i = 0; i < 0x10000; i++) {
+            if (watch[i]) return;
+        }
+        removeAllWatchPoints();
+    }
+
+    void removeAllWatchPoints()
+    {
+        if (watch) free(watch);
+        watch = NULL;
+    }
+
+    // switch the PRG-ROM bank of the 8KB window (index 0: $8000, 1: $A000, 2: $C000, 3: $E000)
+    void setBank(int index, unsigned char bank)
+    {
+        R.bank[index & 3] = bank;
+        _updateBanks();
+        if (bankChanged) bankChanged(arg, index & 3);
+    }
+
+    bool isWatching() { return watch != NULL; }
+
+    // read without any side effect (returns false if addr is an I/O register)
+    bool peekMemory(unsigned short addr, unsigned char* value)
+    {
+        if (0x2000 <= addr && addr < 0x4020) return false;
+        *value = _readMemory(addr);
+        return true;
+    }
+
+    inline unsigned char readMemory(unsigned short addr)
+    {
+        unsigned char value = _readMemory(addr);
+        if (watch && (watch[addr] & WatchRead) && watchHit) watchHit(arg, WatchRead, addr, value);
+        return value;
     }
 
-    void writeMemory(unsigned short addr, unsigned char value)
+    inline void writeMemory(unsigned short addr, unsigned char value)
     {
+        if (watch && (watch[addr] & (WatchWrite | WatchChange))) _checkWriteWatch(addr, value);
         unsigned char page = (addr & 0xFF00) >> 8;
         if (page < 0x20) {
-            M.ram[addr & 0x7FF] = value;
+            if (M.ram[addr & 0x7FF] != value) {
+                M.ram[addr & 0x7FF] = value;
+                ramDirty.mark(addr & 0x7FF);
+            }
         } else if (page < 0x40) {
             ppuWrite(arg, 0x2000 + (addr & 0b111), value);
         } else if (addr == 0x4014) {
@@ -115,9 +360,13 @@ class MMU
         } else if (addr < 0x4020) {
             apuWrite(arg, addr, value);
         } else if (page < 0x60) {
-            M.exRam[addr - 0x4000] = value;
+            if (M.exRam) M.exRam[addr - 0x4000] = value;
         } else if (page < 0x80) {
-            M.sram[addr - 0x6000] = value;
+            if (M.sram) {
+                M.sram[addr - 0x6000] = value;
+                SF.dirty |= 1 << ((addr - 0x6000) >> 10);
+                sramWritten = true;
+            }
         } else {
             // Write to ROM area
         }
@@ -125,6 +374,7 @@ class MMU
 
     bool loadRom(unsigned char* data, size_t size)
     {
+        closeSaveFile();
         _freeData();
         _clearRAM();
         if (size < 16) return false;
@@ -148,11 +398,10 @@ class MMU
         romData.hasTrainer = data[6] & 0b00000100 ? true : false;
         romData.hasButtryBackup = data[6] & 0b00000010 ? true : false;
         romData.mirroring = data[6] & 0b000000001 ? true : false;
-        romData.prgData = (unsigned char*)malloc(romData.prgSize);
-        romData.chrData = (unsigned char*)malloc(romData.chrSize);
         romData.mapper += data[7] & 0b11110000;
         romData.isPlayChoice10 = data[7] & 0b00000010 ? true : false;
         romData.isVS = data[7] & 0b00000001 ? true : false;
+        if (!_allocateRAM(_needsExRam(), _needsSRam(data))) return false;
         int ptr = 16;
         if (romData.hasTrainer) {
             if (size < ptr + 512) return false;
@@ -160,23 +409,27 @@ class MMU
             ptr += 512;
         }
         if (size < ptr + romData.prgSize + romData.chrSize) return false;
-        if (NULL == (romData.prgData = (unsigned char*)malloc(romData.prgSize))) return false;
-        memcpy(romData.prgData, &data[ptr], romData.prgSize);
-        if (0x8000 <= romData.prgSize) {
-            R.bank[0] = 0;
-            R.bank[1] = 1;
-            R.bank[2] = 2;
-            R.bank[3] = 3;
+        if (compact) {
+            // refer the caller's buffer instead of copying it (the buffer must be kept until unload)
+            romData.isReference = true;
+            romData.prgData = &data[ptr];
         } else {
-            R.bank[0] = 0;
-            R.bank[1] = 1;
-            R.bank[2] = 0;
-            R.bank[3] = 1;
+            if (NULL == (romData.prgData = (unsigned char*)malloc(romData.prgSize))) return false;
+            memcpy(romData.prgData, &data[ptr], romData.prgSize);
         }
+        // the initial banks do not notify bankChanged (OpenNES scans the whole PRG-ROM once after loading)
+        for (int i = 0; i < 4; i++) {
+            R.bank[i] = 0x8000 <= romData.prgSize ? i : i & 1; // 16KB PRG-ROM is mirrored at $C000
+        }
+        _updateBanks();
         ptr += romData.prgSize;
         if (0 < romData.chrSize) {
-            if (NULL == (romData.chrData = (unsigned char*)malloc(romData.chrSize))) return false;
-            memcpy(romData.chrData, &data[ptr], romData.chrSize);
+            if (compact) {
+                romData.chrData = &data[ptr];
+            } else {
+                if (NULL == (romData.chrData = (unsigned char*)malloc(romData.chrSize))) return false;
+                memcpy(romData.chrData, &data[ptr], romData.chrSize);
+            }
         } else {
             romData.chrData = NULL;
         }
@@ -186,6 +439,7 @@ class MMU
 
     bool isUsingExRam()
     {
+        if (!M.exRam) return false;
         char buf[0x2000];
         memset(buf, 0, sizeof(buf));
         return 0 != memcmp(M.exRam, buf, 0x2000);
@@ -193,9 +447,81 @@ class MMU
 
     bool isUsingSRam()
     {
+        return M.sram && sramWritten;
+    }
+
+    bool openSaveFile(const char* path)
+    {
+        closeSaveFile();
+        if (!romData.hasButtryBackup || !M.sram) return false;
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || (st.st_size < 0x2000 && ftruncate(fd, 0x2000) < 0)) {
+            close(fd);
+            return false;
+        }
+        void* map = mmap(NULL, 0x2000, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (MAP_FAILED == map) {
+            close(fd);
+            return false;
+        }
+        SF.fd = fd;
+        SF.map = (unsigned char*)map;
+        SF.sram = M.sram;
+        SF.dirtyFrames = 0;
+        if (0 == st.st_size) {
+            // new save file: initialize with the current SRAM
+            memcpy(SF.map, M.sram, 0x2000);
+            SF.dirty = 0xFF;
+        } else {
+            SF.dirty = 0;
+        }
+        M.sram = SF.map;
         char buf[0x2000];
         memset(buf, 0, sizeof(buf));
-        return 0 != memcmp(M.sram, buf, 0x2000);
+        sramWritten = 0 != memcmp(M.sram, buf, 0x2000);
+        return true;
+    }
+
+    void flushSaveFile()
+    {
+        if (SF.map && SF.dirty) {
+            int first = 0;
+            int last = 7;
+            while (0 == (SF.dirty & (1 << first))) first++;
+            while (0 == (SF.dirty & (1 << last))) last--;
+            size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+            size_t from = (first * 0x400) & ~(pageSize - 1);
+            size_t to = (last + 1) * 0x400;
+            msync(&SF.map[from], to - from, MS_ASYNC);
+        }
+        SF.dirty = 0;
+        SF.dirtyFrames = 0;
+    }
+
+    // called at every frame boundary
+    void flushSaveFileIfNeeded()
+    {
+        if (SF.dirty && SF.flushInterval <= ++SF.dirtyFrames) flushSaveFile();
+    }
+
+    void setSaveFileFlushInterval(int frames)
+    {
+        SF.flushInterval = frames < 1 ? 1 : frames;
+    }
+
+    void closeSaveFile()
+    {
+        if (!SF.map) return;
+        flushSaveFile();
+        memcpy(SF.sram, SF.map, 0x2000);
+        M.sram = SF.sram;
+        munmap(SF.map, 0x2000);
+        close(SF.fd);
+        SF.map = NULL;
+        SF.sram = NULL;
+        SF.fd = -1;
     }
 
     size_t getStateSize()
@@ -207,11 +533,11 @@ class MMU
         size += sizeof(R);
         if (isUsingExRam()) {
             size += 3;
-            size += sizeof(M.exRam);
+            size += 0x2000;
         }
         if (isUsingSRam()) {
             size += 3;
-            size += sizeof(M.sram);
+            size += 0x2000;
         }
         return size;
     }
@@ -241,7 +567,7 @@ class MMU
         ptr += ds;
 
         if (isUsingExRam()) {
-            ds = (unsigned short)sizeof(M.exRam);
+            ds = 0x2000;
             cp[ptr++] = 'E';
             cp[ptr++] = (ds & 0xFF00) >> 8;
             cp[ptr++] = ds & 0xFF;
@@ -250,7 +576,7 @@ class MMU
         }
 
         if (isUsingSRam()) {
-            ds = (unsigned short)sizeof(M.sram);
+            ds = 0x2000;
             cp[ptr++] = 'S';
             cp[ptr++] = (ds & 0xFF00) >> 8;
             cp[ptr++] = ds & 0xFF;
@@ -261,7 +587,7 @@ class MMU
 
     size_t loadState(void* data)
     {
-        _clearRAM();
+        _clearRAM(SF.map != NULL); // keep the battery backup only while the save file is mapped
         char* cp = (char*)data;
         if (memcmp(cp, "MM", 2)) return 0;
         size_t size = cp[2];
@@ -275,11 +601,21 @@ class MMU
             switch (t) {
                 case 'W': memcpy(M.ram, &cp[ptr], ds); break;
                 case 'R': memcpy(&R, &cp[ptr], ds); break;
-                case 'E': memcpy(M.exRam, &cp[ptr], ds); break;
-                case 'S': memcpy(M.sram, &cp[ptr], ds); break;
+                case 'E':
+                    if (M.exRam) memcpy(M.exRam, &cp[ptr], ds);
+                    break;
+                case 'S':
+                    if (M.sram) {
+                        memcpy(M.sram, &cp[ptr], ds);
+                        sramWritten = true;
+                        SF.dirty = 0xFF;
+                    }
+                    break;
             }
             ptr += ds;
         }
+        _updateBanks();
+        for (int i = 0; bankChanged && i < 4; i++) bankChanged(arg, i);
         return size;
     }
 };
@@ -7,6 +7,7 @@
 #ifndef INCLUDE_PPU_HPP
 #define INCLUDE_PPU_HPP
 #include "OpenNES.h"
+#include <vector>
 
 class PPU
 {
@@ -14,15 +15,21 @@ class PPU
     struct Callback {
         void* arg;
         void (*endOfFrame)(void* arg);
+        void (*watchHit)(void* arg, unsigned char flag, unsigned short addr, unsigned char value);
     } CB;
+    unsigned char* watch; // watch flags of each VRAM address (NULL if no watchpoint is armed)
+    unsigned int clockCount; // total number of ticks (timestamp of the access log)
+    bool drawing;            // false: headless or recording the access log for the Renderer
     int frameCycleClock;
     bool dipswIgnoreMirroring;
     bool dipswMirroring;
+    unsigned char* chrRam;  // 8KB pattern table memory (NULL if the pattern tables refer to CHR-ROM)
+    bool isPatternWritable; // false: the pattern tables refer to CHR-ROM
 
   public:
-    unsigned char display[256 * 240]; // NES pallete display
+    unsigned char* display;    // NES pallete display (256x240: NULL if headless)
+    unsigned char* pattern[2]; // pattern tables (refer to chrRam or CHR-ROM)
     struct VideoMemory {
-        unsigned char pattern[2][0x1000];
         unsigned char name[4]; // 0: LeftTop, 1: RightTop, 2: LeftBottom, 3: RightBottom
         unsigned char nameBuffer[4][0x400];
         unsigned char palette[8][4];
@@ -31,6 +38,27 @@ class PPU
         int vramAddrUpdateClock;
     } M;
 
+    // Access log that has side effects to the PPU state (replayed by the Renderer on the worker thread)
+    enum LogType {
+        LogOut = 0, // outPort
+        LogIn = 1,  // inPort ($2002 or $2007)
+        LogOAM = 2, // writeOAM (OAM DMA or $2004)
+    };
+    struct Log {
+        unsigned int clock; // clockCount at the access
+        unsigned short addr;
+        unsigned char type;
+        unsigned char value;
+    };
+    std::vector<Log>* log; // NULL if not recording
+
+    // Changed ranges of M.oam, M.palette and M.nameBuffer since the last observation
+    struct DirtyArea {
+        MMU::DirtyRange oam;
+        MMU::DirtyRange palette;
+        MMU::DirtyRange name;
+    } D;
+
     // Temporarily stores work information obtained from ctrl and mask.
     // Store to $ 2000, $ 2001, or recalculate on state load.
     // Note: This data does not require state saving.
@@ -59,32 +87,167 @@ class PPU
         int line;
     } R;
 
+    PPU(bool headless = false)
+    {
+        memset(&CB, 0, sizeof(CB));
+        memset(&D, 0, sizeof(D));
+        this->display = headless ? NULL : (unsigned char*)malloc(256 * 240);
+        this->chrRam = NULL;
+        this->isPatternWritable = false;
+        this->pattern[0] = NULL;
+        this->pattern[1] = NULL;
+        this->watch = NULL;
+        this->log = NULL;
+        this->clockCount = 0;
+        this->drawing = this->display ? true : false;
+    }
+
+    ~PPU()
+    {
+        if (display) free(display);
+        if (chrRam) free(chrRam);
+        if (watch) free(watch);
+    }
+
     void setEndOfFrame(void* arg, void (*endOfFrame)(void* arg))
     {
         CB.arg = arg;
         CB.endOfFrame = endOfFrame;
     }
 
-    void setup(MMU::RomData* rom, bool isNTSC)
+    void setWatchCallback(void* arg, void (*watchHit)(void* arg, unsigned char flag, unsigned short addr, unsigned char value))
+    {
+        CB.arg = arg;
+        CB.watchHit = watchHit;
+    }
+
+    // the mirrors of the name tables ($3000-$3EFF) and the palette ($3F20-$3FFF) are watched together
+    bool addWatchPoint(unsigned short from, unsigned short to, unsigned char flags)
+    {
+        if (!watch && NULL == (watch = (unsigned char*)calloc(0x4000, 1))) return false;
+        flags &= MMU::WatchRead | MMU::WatchWrite | MMU::WatchChange;
+        for (unsigned int addr = from; addr <= to && addr < 0x4000; addr++) {
+            if (addr < 0x2000) {
+                watch[addr] |= flags;
+            } else if (addr < 0x3F00) {
+                watch[0x2000 + (addr & 0xFFF)] |= flags;
+                if ((addr & 0xFFF) < 0xF00) watch[0x3000 + (addr & 0xFFF)] |= flags;
+            } else {
+                for (int i = 0x3F00; i < 0x4000; i += 0x20) watch[(addr & 0x1F) + i] |= flags;
+            }
+        }
+        return true;
+    }
+
+    // the watch table is released when all watchpoints are removed
+    void removeWatchPoint(unsigned short from, unsigned short to, unsigned char flags)
+    {
+        if (!watch) return;
+        for (unsigned int addr = from; addr <= to && addr < 0x4000; addr++) {
+            if (addr < 0x2000) {
+                watch[addr] &= ~flags;
+            } else if (addr < 0x3F00) {
+                watch[0x2000 + (addr & 0xFFF)] &= ~flags;
+                if ((addr & 0xFFF) < 0xF00) watch[0x3000 + (addr & 0xFFF)] &= ~flags;
+            } else {
+                for (int i = 0x3F00; i < 0x4000; i += 0x20) watch[(addr & 0x1F) + i] &= ~flags;
+            }
+        }
+        for (int i = 0; i < 0x4000; i++) {
+            if (watch[i]) return;
+        }
+        removeAllWatchPoints();
+    }
+
+    void removeAllWatchPoints()
+    {
+        if (watch) free(watch);
+        watch = NULL;
+    }
+
+    // allocate or release the display (the PPU that records the access log for the Renderer does not draw)
+    bool setHeadless(bool headless)
+    {
+        if (headless && display) {
+            free(display);
+            display = NULL;
+        } else if (!headless && !display) {
+            if (NULL == (display = (unsigned char*)calloc(256 * 240, 1))) return false;
+        }
+        this->drawing = display && !log;
+        return true;
+    }
+
+    void setLog(std::vector<Log>* log)
+    {
+        this->log = log;
+        this->drawing = display && !log;
+    }
+
+    unsigned int getClockCount() { return clockCount; }
+
+    // copy the whole state from the other PPU (the pattern tables refer to the same CHR-ROM)
+    bool copyState(PPU* src)
+    {
+        if (src->isPatternWritable) {
+            if (!chrRam && NULL == (chrRam = (unsigned char*)malloc(0x2000))) return false;
+            memcpy(chrRam, src->chrRam, 0x2000);
+            pattern[0] = &chrRam[src->pattern[0] - src->chrRam];
+            pattern[1] = &chrRam[src->pattern[1] - src->chrRam];
+        } else {
+            pattern[0] = src->pattern[0];
+            pattern[1] = src->pattern[1];
+        }
+        isPatternWritable = src->isPatternWritable;
+        memcpy(&M, &src->M, sizeof(M));
+        memcpy(&R, &src->R, sizeof(R));
+        memcpy(&W, &src->W, sizeof(W));
+        frameCycleClock = src->frameCycleClock;
+        dipswIgnoreMirroring = src->dipswIgnoreMirroring;
+        dipswMirroring = src->dipswMirroring;
+        clockCount = src->clockCount;
+        return true;
+    }
+
+    bool setup(MMU::RomData* rom, bool isNTSC, bool compact = false)
     {
         memset(&R, 0, sizeof(R));
         memset(&M, 0, sizeof(M));
+        D.oam.markAll(sizeof(M.oam));
+        D.palette.markAll(sizeof(M.palette));
+        D.name.markAll(sizeof(M.nameBuffer));
         this->dipswIgnoreMirroring = rom->ignoreMirroring;
         this->dipswMirroring = rom->mirroring;
         _updateWorkAreaCtrl(0);
         frameCycleClock = isNTSC ? 89342 : 105710;
+        if (compact && 0x1000 <= rom->chrSize) {
+            // refer to CHR-ROM directly (writes to the pattern tables are ignored as same as the real hardware)
+            if (chrRam) free(chrRam);
+            chrRam = NULL;
+            isPatternWritable = false;
+            pattern[0] = &rom->chrData[0x0000];
+            pattern[1] = 0x2000 <= rom->chrSize ? &rom->chrData[0x1000] : &rom->chrData[0x0000];
+            return true;
+        }
+        if (!chrRam && NULL == (chrRam = (unsigned char*)malloc(0x2000))) return false;
+        memset(chrRam, 0, 0x2000);
+        isPatternWritable = true;
+        pattern[0] = &chrRam[0x0000];
+        pattern[1] = &chrRam[0x1000];
         if (0x1000 <= rom->chrSize) {
-            memcpy(M.pattern[0], &rom->chrData[0x0000], 0x1000);
+            memcpy(pattern[0], &rom->chrData[0x0000], 0x1000);
             if (0x2000 <= rom->chrSize) {
-                memcpy(M.pattern[1], &rom->chrData[0x1000], 0x1000);
+                memcpy(pattern[1], &rom->chrData[0x1000], 0x1000);
             } else {
-                memcpy(M.pattern[1], &rom->chrData[0x0000], 0x1000);
+                memcpy(pattern[1], &rom->chrData[0x0000], 0x1000);
             }
         }
+        return true;
     }
 
     inline unsigned char inPort(unsigned short addr)
     {
+        if (log && (addr == 0x2002 || addr == 0x2007)) _record(LogIn, addr, 0);
         switch (addr) {
             case 0x2002: {
                 R.internalFlag = 0;
@@ -94,14 +257,8 @@ class PPU
             }
             case 0x2004: return M.oam[R.oamAddr];
             case 0x2007:
-                unsigned char result = 0;
-                if (R.vramAddr < 0x2000) {
-                    result = M.pattern[R.vramAddr / 0x1000][R.vramAddr & 0xFFF];
-                } else if (R.vramAddr < 0x3F00) {
-                    result = M.nameBuffer[(R.vramAddr & 0xFFF) / 0x400][R.vramAddr & 0x3FF];
-                } else if (R.vramAddr < 0x4000) {
-                    result = M.palette[(R.vramAddr & 0x1F) / 4][R.vramAddr & 0x3];
-                }
+                unsigned char result = _readVRAM(R.vramAddr);
+                if (watch && (watch[R.vramAddr] & MMU::WatchRead) && CB.watchHit) CB.watchHit(CB.arg, MMU::WatchRead, R.vramAddr, result);
                 R.vramAddr += W.ctrl.vramIncrement;
                 R.vramAddr &= 0x3FFF;
                 return result;
@@ -111,11 +268,12 @@ class PPU
 
     inline void outPort(unsigned short addr, unsigned char value)
     {
+        if (log && addr != 0x2004) _record(LogOut, addr, value);
         switch (addr) {
             case 0x2000: _updateWorkAreaCtrl(value); break;
             case 0x2001: R.mask = value; break;
             case 0x2003: R.oamAddr = value; break;
-            case 0x2004: M.oam[R.oamAddr] = value; break;
+            case 0x2004: writeOAM(R.oamAddr, value); break;
             case 0x2005: // Scroll
                 R.scroll[R.internalFlag & 1] = value;
                 R.internalFlag ^= 0b00000001;
@@ -130,12 +288,15 @@ class PPU
                 R.internalFlag ^= 0b00000001;
                 break;
             case 0x2007: { // write VRAM
+                if (watch && (watch[R.vramAddr] & (MMU::WatchWrite | MMU::WatchChange))) _checkWriteWatch(R.vramAddr, value);
                 if (R.vramAddr < 0x2000) {
-                    M.pattern[R.vramAddr / 0x1000][R.vramAddr & 0xFFF] = value;
+                    if (isPatternWritable) pattern[R.vramAddr / 0x1000][R.vramAddr & 0xFFF] = value;
                 } else if (R.vramAddr < 0x3F00) {
                     M.nameBuffer[(R.vramAddr & 0xFFF) / 0x400][R.vramAddr & 0x3FF] = value;
+                    D.name.mark(R.vramAddr & 0xFFF);
                 } else if (R.vramAddr < 0x4000) {
                     M.palette[(R.vramAddr & 0x1F) / 4][R.vramAddr & 0x3] = value;
+                    D.palette.mark(R.vramAddr & 0x1F);
                 }
                 R.vramAddr += W.ctrl.vramIncrement;
                 R.vramAddr &= 0x3FFF;
@@ -144,8 +305,35 @@ class PPU
         }
     }
 
+    inline void writeOAM(unsigned char addr, unsigned char value)
+    {
+        if (log) _record(LogOAM, addr, value);
+        if (M.oam[addr] != value) {
+            M.oam[addr] = value;
+            D.oam.mark(addr);
+        }
+    }
+
+    // number of PPU clocks until the next event that changes $2002 or requests NMI
+    // (the start and the end of vblank, and the pending VRAM address update)
+    int getClocksUntilNextEvent()
+    {
+        const int events[2] = {241 * 341 + 1, 261 * 341 + 1};
+        int result = frameCycleClock;
+        for (int i = 0; i < 2; i++) {
+            int clocks = (events[i] - R.clock + frameCycleClock) % frameCycleClock;
+            if (clocks && clocks < result) result = clocks;
+        }
+        if (R.internalFlag & 0b10000000) {
+            int clocks = (M.vramAddrUpdateClock - R.clock + frameCycleClock) % frameCycleClock;
+            if (clocks && clocks < result) result = clocks;
+        }
+        return result;
+    }
+
     inline void tick(M6502* cpu)
     {
+        clockCount++;
         R.clock++;
         R.clock %= frameCycleClock;
         const int pixel = R.clock % 341;
@@ -160,13 +348,13 @@ class PPU
             switch (R.line) {
                 case 0:
                     // clear display to the sprite palette #0 color 0
-                    memset(display, M.palette[4][0], sizeof(display));
+                    if (drawing) memset(display, M.palette[4][0], 256 * 240);
                     break;
             }
         }
         // draw BG pixel if current position is in (0, 0) until (255, 239)
         if (R.line < 240) {
-            if (pixel < 256) {
+            if (pixel < 256 && drawing) {
                 unsigned char c = _bgPixelOf(pixel, R.line);
                 if (0 == (c & 0x80)) {
                     display[R.line * 256 + pixel] = c;
@@ -174,14 +362,47 @@ class PPU
             }
         } else if (R.line == 241 && pixel == 1) {
             R.status |= 0b10000000;
-            if (W.ctrl.generateNMI) cpu->NMI();
-            CB.endOfFrame(CB.arg);
+            if (W.ctrl.generateNMI && cpu) cpu->NMI();
+            if (CB.endOfFrame) CB.endOfFrame(CB.arg);
         } else if (R.line == 261 && pixel == 1) {
             R.status &= 0b00011111;
         }
     }
 
   private:
+    inline void _record(unsigned char type, unsigned short addr, unsigned char value)
+    {
+        Log entry;
+        entry.clock = clockCount;
+        entry.addr = addr;
+        entry.type = type;
+        entry.value = value;
+        log->push_back(entry);
+    }
+
+    inline unsigned char _readVRAM(unsigned short addr)
+    {
+        if (addr < 0x2000) {
+            return pattern[addr / 0x1000][addr & 0xFFF];
+        } else if (addr < 0x3F00) {
+            return M.nameBuffer[(addr & 0xFFF) / 0x400][addr & 0x3FF];
+        } else if (addr < 0x4000) {
+            return M.palette[(addr & 0x1F) / 4][addr & 0x3];
+        }
+        return 0;
+    }
+
+    void _checkWriteWatch(unsigned short addr, unsigned char value)
+    {
+        if (!CB.watchHit) return;
+        unsigned char flag = watch[addr];
+        if ((flag & MMU::WatchChange) && _readVRAM(addr) != value) {
+            CB.watchHit(CB.arg, MMU::WatchChange, addr, value);
+        } else if (flag & MMU::WatchWrite) {
+            CB.watchHit(CB.arg, MMU::WatchWrite, addr, value);
+        }
+    }
+
     inline unsigned char _bgPixelOf(int x, int y)
     {
         x += R.scroll[0];
@@ -196,15 +417,14 @@ class PPU
         attrPtr += y / 16 * 16;
         attrPtr += 960;
         unsigned char attr = M.nameBuffer[M.name[nameIndex]][attrPtr];
-        unsigned char attrBit = 0b11000000;
         int attrShift = ((x / 8) & 1) * 2 + ((y / 8) & 1) * 4;
-        attr &= attrBit >> attrShift;
         attr >>= attrShift;
+        attr &= 0b11; // palette index (0-3)
         x &= 0b0111;
         int bit = 0b10000000 >> x;
         y &= 0b0111;
-        unsigned char colorU = M.pattern[W.ctrl.bgPatternIndex][pattern + y] & bit ? 0x02 : 0x00;
-        unsigned char colorL = M.pattern[W.ctrl.bgPatternIndex][pattern + 8 + y] & bit ? 0x01 : 0x00;
+        unsigned char colorU = this->pattern[W.ctrl.bgPatternIndex][pattern + y] & bit ? 0x02 : 0x00;
+        unsigned char colorL = this->pattern[W.ctrl.bgPatternIndex][pattern + 8 + y] & bit ? 0x01 : 0x00;
         unsigned char color = colorU | colorL;
         return color ? M.palette[attr][color] : 0x80;
     }
@@ -0,0 +1,115 @@
+// SUZUKI PLAN - OpenNES (GPLv3)
+#ifndef INCLUDE_RENDERER_HPP
+#define INCLUDE_RENDERER_HPP
+#include "OpenNES.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Renders the frames on the worker thread.
+ * The PPU on the emulation thread only keeps the timing (status, vblank and NMI) and records the accesses
+ * that have side effects with the timestamp. The PPU of the Renderer replays the log dot by dot and draws the pixels.
+ */
+class Renderer
+{
+  private:
+    PPU* source; // PPU on the emulation thread
+    std::vector<PPU::Log> logs[2];
+    int recordingIndex;
+    unsigned int targetClock;
+    bool busy;
+    bool quit;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+
+    void _run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this] { return busy || quit; });
+            if (quit) return;
+            lock.unlock();
+            _replay(logs[1 - recordingIndex], targetClock);
+            lock.lock();
+            busy = false;
+            cv.notify_all();
+        }
+    }
+
+    void _replay(std::vector<PPU::Log>& log, unsigned int clock)
+    {
+        for (size_t i = 0; i < log.size(); i++) {
+            PPU::Log& entry = log[i];
+            while (0 < (int)(entry.clock - ppu->getClockCount())) ppu->tick(NULL);
+            switch (entry.type) {
+                case PPU::LogOut: ppu->outPort(entry.addr, entry.value); break;
+                case PPU::LogIn: ppu->inPort(entry.addr); break;
+                case PPU::LogOAM: ppu->writeOAM((unsigned char)entry.addr, entry.value); break;
+            }
+        }
+        while (0 < (int)(clock - ppu->getClockCount())) ppu->tick(NULL);
+        log.clear();
+    }
+
+  public:
+    PPU* ppu; // PPU on the worker thread
+
+    Renderer(PPU* source)
+    {
+        this->source = source;
+        this->ppu = new PPU();
+        this->recordingIndex = 0;
+        this->targetClock = 0;
+        this->busy = false;
+        this->quit = false;
+        reset();
+        this->thread = std::thread([this] { _run(); });
+    }
+
+    ~Renderer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cv.notify_all();
+        thread.join();
+        source->setLog(NULL);
+        delete ppu;
+    }
+
+    // synchronize the state with the source PPU (call after loading ROM)
+    bool reset()
+    {
+        wait();
+        logs[0].clear();
+        logs[1].clear();
+        source->setLog(&logs[recordingIndex]);
+        return ppu->copyState(source);
+    }
+
+    // wait for the completion of the frame that is being rendered
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return !busy; });
+    }
+
+    // render the recorded accesses until the current clock of the source PPU (call after wait)
+    void submit()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            recordingIndex = 1 - recordingIndex;
+            source->setLog(&logs[recordingIndex]);
+            targetClock = source->getClockCount();
+            busy = true;
+        }
+        cv.notify_all();
+    }
+};
+
+#endif // INCLUDE_RENDERER_HPP
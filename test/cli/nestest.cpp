@@ -84,7 +84,7 @@ int main(int argc, char* argv[])
     unsigned short breakAddr = hex2i(argv[3]);
     if (breakAddr) {
         printf("break address: $%04X\n", breakAddr);
-        nes.cpu->addBreakPoint(breakAddr, [](void* arg) {
+        nes.addBreakPoint(breakAddr, [](void* arg) {
             OpenNES* nes = (OpenNES*)arg;
             printf("DETECT BREAK: $%04X\n", nes->cpu->R.pc);
             displayToBitmap(nes->display);
@@ -0,0 +1,257 @@
+#include "../../src/OpenNES.h"
+#include <chrono>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// every ROM is executed in each mode and all modes must produce the golden hashes
+enum Mode {
+    Serial,   // default
+    IdleSkip, // OpenNES::setIdleSkip(true)
+    Parallel, // OpenNES::setParallelRendering(true)
+    ModeCount,
+};
+static const char* modeNames[ModeCount] = {"serial", "idle-skip", "parallel"};
+
+struct Result {
+    bool loaded;
+    bool detectBreak;
+    unsigned long long display;
+    unsigned long long ram;
+    double msec;
+};
+
+struct Job {
+    char path[1024];
+    int frames;
+    unsigned short breakAddr;
+    bool hasGolden;
+    unsigned long long goldenDisplay;
+    unsigned long long goldenRam;
+    bool listed; // false: found in the ROM directory but not in the manifest (run only if updating)
+    Result results[ModeCount];
+};
+
+struct Task {
+    Job* job;
+    Mode mode;
+    OpenNES* nes;
+};
+
+static unsigned long long fnv1a(const void* data, size_t size)
+{
+    const unsigned char* ptr = (const unsigned char*)data;
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= ptr[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static void findRoms(const char* dir, std::vector<Job>& jobs)
+{
+    DIR* dp = opendir(dir);
+    if (!dp) return;
+    struct dirent* ent;
+    while (NULL != (ent = readdir(dp))) {
+        if ('.' == ent->d_name[0]) continue;
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        struct stat st;
+        if (stat(path, &st)) continue;
+        if (S_ISDIR(st.st_mode)) {
+            findRoms(path, jobs);
+            continue;
+        }
+        size_t len = strlen(path);
+        if (len < 4 || strcmp(&path[len - 4], ".nes")) continue;
+        bool exist = false;
+        for (size_t i = 0; !exist && i < jobs.size(); i++) exist = 0 == strcmp(jobs[i].path, path);
+        if (exist) continue;
+        Job job;
+        memset(&job, 0, sizeof(job));
+        strcpy(job.path, path);
+        job.frames = 60;
+        jobs.push_back(job);
+    }
+    closedir(dp);
+}
+
+static bool readManifest(const char* manifest, std::vector<Job>& jobs)
+{
+    FILE* fp = fopen(manifest, "rt");
+    if (!fp) return false;
+    char line[2048];
+    while (fgets(line, sizeof(line), fp)) {
+        if ('#' == line[0] || '\n' == line[0]) continue;
+        Job job;
+        memset(&job, 0, sizeof(job));
+        char display[32];
+        char ram[32];
+        unsigned int breakAddr;
+        if (5 != sscanf(line, "%1023s %d %x %31s %31s", job.path, &job.frames, &breakAddr, display, ram)) continue;
+        job.breakAddr = (unsigned short)breakAddr;
+        job.listed = true;
+        job.hasGolden = '-' != display[0] && '-' != ram[0];
+        if (job.hasGolden) {
+            job.goldenDisplay = strtoull(display, NULL, 16);
+            job.goldenRam = strtoull(ram, NULL, 16);
+        }
+        jobs.push_back(job);
+    }
+    fclose(fp);
+    return true;
+}
+
+static bool writeManifest(const char* manifest, std::vector<Job>& jobs)
+{
+    FILE* fp = fopen(manifest, "wt");
+    if (!fp) return false;
+    fprintf(fp, "# golden hashes of test/cli/romtest (update: make golden)\n");
+    fprintf(fp, "# rom frames break display-hash ram-hash\n");
+    for (size_t i = 0; i < jobs.size(); i++) {
+        Job& job = jobs[i];
+        if (!job.listed && !job.results[Serial].loaded) continue;
+        if (job.results[Serial].loaded) {
+            fprintf(fp, "%s %d %04X %016llX %016llX\n", job.path, job.frames, job.breakAddr, job.results[Serial].display, job.results[Serial].ram);
+        } else {
+            fprintf(fp, "%s %d %04X - -\n", job.path, job.frames, job.breakAddr);
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+static void takeHash(Task* task)
+{
+    Result* result = &task->job->results[task->mode];
+    result->display = fnv1a(task->nes->getLatestDisplay(), 256 * 240 * 2);
+    result->ram = fnv1a(task->nes->mmu->M.ram, sizeof(task->nes->mmu->M.ram));
+}
+
+static void run(Task task)
+{
+    Job* job = task.job;
+    Result* result = &job->results[task.mode];
+    auto start = std::chrono::steady_clock::now();
+    OpenNES nes(true, OpenNES::ColorMode::RGB555);
+    task.nes = &nes;
+    if (task.mode == IdleSkip) nes.setIdleSkip(true);
+    if (task.mode == Parallel) nes.setParallelRendering(true);
+    result->loaded = nes.loadRomFile(job->path);
+    if (result->loaded) {
+        if (job->breakAddr) {
+            // take the hashes at the first break (the rest of the frame is still executed by the tick)
+            nes.setWatchCallback(&task, [](void* arg, OpenNES::WatchTarget target, unsigned char flag, unsigned short addr, unsigned char value) {
+                Task* task = (Task*)arg;
+                Result* result = &task->job->results[task->mode];
+                if (result->detectBreak) return;
+                result->detectBreak = true;
+                takeHash(task);
+            });
+            nes.addWatchPoint(OpenNES::WatchTarget::CPUAddress, job->breakAddr, job->breakAddr, MMU::WatchExecute);
+        }
+        for (int i = 0; i < job->frames && !result->detectBreak; i++) {
+            nes.tick(0, 0);
+        }
+        if (!result->detectBreak) takeHash(&task);
+    }
+    result->msec = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[])
+{
+    bool update = false;
+    int argi = 1;
+    if (argi < argc && 0 == strcmp(argv[argi], "-u")) {
+        update = true;
+        argi++;
+    }
+    if (argc <= argi) {
+        puts("usage: romtest [-u] manifest [rom-directory]");
+        return 1;
+    }
+    const char* manifest = argv[argi];
+    const char* romDirectory = argi + 1 < argc ? argv[argi + 1] : "test/rom";
+    std::vector<Job> jobs;
+    if (!readManifest(manifest, jobs) && !update) {
+        printf("cannot read the manifest: %s\n", manifest);
+        return 1;
+    }
+    findRoms(romDirectory, jobs);
+
+    // the emulator core prints the debug messages to stdout/stderr, so discard them while running
+    fflush(stdout);
+    fflush(stderr);
+    int out = dup(1);
+    int err = dup(2);
+    FILE* report = fdopen(dup(1), "wt");
+    FILE* devnull = fopen("/dev/null", "wt");
+    if (devnull) {
+        dup2(fileno(devnull), 1);
+        dup2(fileno(devnull), 2);
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (!jobs[i].listed && !update) continue;
+        for (int mode = 0; mode < ModeCount; mode++) {
+            Task task;
+            task.job = &jobs[i];
+            task.mode = (Mode)mode;
+            task.nes = NULL;
+            threads.push_back(std::thread(run, task));
+        }
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    double msec = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    fflush(stdout);
+    fflush(stderr);
+    dup2(out, 1);
+    dup2(err, 2);
+    if (devnull) fclose(devnull);
+
+    int failed = 0;
+    int count = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        Job& job = jobs[i];
+        if (!job.listed && !update) {
+            fprintf(report, "UNLISTED     %8s   %-10s %s (add it with `make golden`)\n", "-", "-", job.path);
+            continue;
+        }
+        count += ModeCount;
+        Result& serial = job.results[Serial];
+        for (int mode = 0; mode < ModeCount; mode++) {
+            Result& r = job.results[mode];
+            const char* result;
+            if (!r.loaded) {
+                result = "LOAD FAILED";
+            } else if (mode != Serial && (r.display != serial.display || r.ram != serial.ram)) {
+                result = "DIFFERS";
+            } else if (update) {
+                result = "UPDATED";
+            } else if (!job.hasGolden) {
+                result = "NO GOLDEN";
+            } else if (r.display != job.goldenDisplay || r.ram != job.goldenRam) {
+                result = "FAILED";
+            } else {
+                result = "PASSED";
+            }
+            if (strcmp(result, "PASSED") && strcmp(result, "UPDATED")) failed++;
+            fprintf(report, "%-12s %8.1fms %-10s %s%s\n", result, r.msec, modeNames[mode], job.path, r.detectBreak ? " (break)" : "");
+        }
+    }
+    fprintf(report, "%d/%d passed in %.1fms\n", count - failed, count, msec);
+    if (update && !writeManifest(manifest, jobs)) {
+        fprintf(report, "cannot write the manifest: %s\n", manifest);
+        failed++;
+    }
+    if (!update && failed) fprintf(report, "(record the golden hashes with `make golden` if the changes are expected)\n");
+    fclose(report);
+    return failed ? 1 : 0;
+}